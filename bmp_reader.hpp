@@ -10,6 +10,21 @@
 #include <memory>
 #include <math.h>
 #include <bitset>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#if __cplusplus >= 202002L
+#include <bit>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define BMP_READER_MMAP
+#endif
 
 static constexpr int BITMAP_HEADER_SIZE = 14;
 
@@ -23,10 +38,25 @@ static constexpr int COMPRESSION_METHOD_OFFSET = 30;
 static constexpr int PIXARAY_SIZE_OFFSET = 34;
 static constexpr int COLOR_PALLETE_OFFSET = 46;
 static constexpr int HALFTONING_OFFSET = 60;
+static constexpr int BITFIELD_MASKS_OFFSET = 54;
+static constexpr int ALPHA_MASK_OFFSET = 66;
+
+//Core header offsets
+static constexpr int CORE_WIDTH_OFFSET = 18;
+static constexpr int CORE_HEIGHT_OFFSET = 20;
+static constexpr int CORE_BITS_PER_PIXEL_OFFSET = 24;
+
+//OS/2 bitmap array
+static constexpr int BITMAP_ARRAY_HEADER_SIZE = 14;
+static constexpr int BITMAP_ARRAY_NEXT_OFFSET = 6;
+static constexpr int BITMAP_ARRAY_DISPLAY_WIDTH_OFFSET = 10;
+static constexpr int BITMAP_ARRAY_DISPLAY_HEIGHT_OFFSET = 12;
+static constexpr size_t BITMAP_ARRAY_MAX_IMAGES = 1024;
 
 //Headers
 static constexpr int DIB_BITMAPCOREHEADER = 12;
 static constexpr int DIB_OS22XBITMAPHEADER = 64;
+static constexpr int DIB_OS22XBITMAPHEADER_SMALL = 16;
 static constexpr int DIB_BITMAPINFOHEADER = 40;
 static constexpr int DIB_BITMAPV2HEADER = 52;
 static constexpr int DIB_BITMAPV3HEADER = 56;
@@ -45,12 +75,16 @@ static constexpr int BI_CMYK = 11;
 static constexpr int BI_CMYKRLE8 = 12;
 static constexpr int BI_CMYKRLE4 = 13;
 
+//Lazy decoding
+static constexpr int LAZY_ROW_BLOCK_HEIGHT = 16;
+static constexpr int LAZY_ROW_BLOCK_CACHE_SIZE = 4;
+
 
 struct RGB_color{
-    RGB_color(uint8_t _r, uint8_t _g, uint8_t _b) : r(_r), g(_g), b(_b), a(255) {}
-    RGB_color(uint8_t _r, uint8_t _g, uint8_t _b, uint8_t _a) : r(_r), g(_g), b(_b), a(_a) {}
+    constexpr RGB_color(uint8_t _r, uint8_t _g, uint8_t _b) : r(_r), g(_g), b(_b), a(255) {}
+    constexpr RGB_color(uint8_t _r, uint8_t _g, uint8_t _b, uint8_t _a) : r(_r), g(_g), b(_b), a(_a) {}
     //RGB_color(const RGB_color& _c) : r(_c.r), g(_c.g), b(_c.b) {}
-    RGB_color() : r(0), g(0), b(0),a(0) {}
+    constexpr RGB_color() : r(0), g(0), b(0),a(0) {}
     uint8_t r,g,b,a;
 };
 
@@ -61,25 +95,159 @@ enum pformat{
         RGBA32F
     };
 
+constexpr int pformat_stride(pformat format){
+    switch(format){
+        case RGB: return 3;
+        case RGBA: return 4;
+        case RGB32F: return 12;
+        case RGBA32F: return 16;
+    }
+    return 4;
+}
+
+enum load_mode{
+        EAGER,
+        LAZY
+    };
+
+//Describes one image of a file. Plain bitmaps hold a single image while
+//OS/2 bitmap arrays hold one per resolution, for color icons and pointers
+//this is the color bitmap and for monochrome ones the double height AND/XOR mask
+struct bmp_image_info{
+    std::string type;
+    uint32_t header_offset;
+    uint32_t DIB_header_size;
+    int width, height;
+    bool topdown;
+    uint16_t bits_per_pixel;
+    uint32_t color_pallete_colors;
+    uint32_t image_data_offset;
+    //Display resolution the image was designed for, 0 when not specified
+    uint16_t display_width, display_height;
+};
+
+//Statistics gathered while decoding, over the pixels as 8 bit RGBA
+//independent of the selected pixel format
+struct bmp_stats{
+    //XXH64 of every row, combined from top to bottom
+    uint64_t hash = 0;
+    uint64_t histogram[4][256] = {};
+    uint8_t min[4] = {};
+    uint8_t max[4] = {};
+    double mean[4] = {};
+    //Every alpha value is 255
+    bool opaque = false;
+    //Every alpha value is 0
+    bool transparent = false;
+};
+
+//Streaming XXH64 fed one 32 bit word at a time, ie one RGBA pixel
+class xxh64_stream{
+public:
+    explicit xxh64_stream(uint64_t _seed) : seed(_seed) {
+        reset();
+    }
+
+    void reset(){
+        lanes[0] = seed + PRIME64_1 + PRIME64_2;
+        lanes[1] = seed + PRIME64_2;
+        lanes[2] = seed;
+        lanes[3] = seed - PRIME64_1;
+        stripe_words = 0;
+        total_length = 0;
+    }
+
+    void update(uint32_t word){
+        stripe[stripe_words++] = word;
+        total_length += sizeof(uint32_t);
+        if(stripe_words == 8){
+            for(int i = 0; i < 4; i++){
+                lanes[i] = round(lanes[i], stripe[2*i] | (static_cast<uint64_t>(stripe[2*i+1]) << 32));
+            }
+            stripe_words = 0;
+        }
+    }
+
+    uint64_t digest(){
+        uint64_t h64;
+        if(total_length >= 32){
+            h64 = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+            for(int i = 0; i < 4; i++){
+                h64 ^= round(0, lanes[i]);
+                h64 = h64 * PRIME64_1 + PRIME64_4;
+            }
+        }
+        else{
+            h64 = seed + PRIME64_5;
+        }
+        h64 += total_length;
+        int i = 0;
+        for(; i + 1 < stripe_words; i += 2){
+            h64 ^= round(0, stripe[i] | (static_cast<uint64_t>(stripe[i+1]) << 32));
+            h64 = rotl(h64, 27) * PRIME64_1 + PRIME64_4;
+        }
+        if(i < stripe_words){
+            h64 ^= stripe[i] * PRIME64_1;
+            h64 = rotl(h64, 23) * PRIME64_2 + PRIME64_3;
+        }
+        h64 ^= h64 >> 33;
+        h64 *= PRIME64_2;
+        h64 ^= h64 >> 29;
+        h64 *= PRIME64_3;
+        h64 ^= h64 >> 32;
+        return h64;
+    }
+private:
+    static constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+    uint64_t seed;
+    uint64_t lanes[4];
+    uint32_t stripe[8];
+    int stripe_words;
+    uint64_t total_length;
+
+    static uint64_t rotl(uint64_t v, int r){
+        return (v << r) | (v >> (64 - r));
+    }
+
+    static uint64_t round(uint64_t acc, uint64_t input){
+        acc += input * PRIME64_2;
+        acc = rotl(acc, 31);
+        return acc * PRIME64_1;
+    }
+};
+
 std::ostream& operator<<(std::ostream &strm, const RGB_color &a) {
     return strm << "R: " << static_cast<int>(a.r) << " G: " << static_cast<int>(a.g) << " B: "<< static_cast<int>(a.b) <<'\n';
 }
 
 class bmp_reader{
 public:
-    bmp_reader(const std::string& _path, pformat _pixel_format) : path(_path), pixel_format(_pixel_format) {
-        switch(pixel_format){
-            case RGB: stride = 3; break;
-            case RGBA: stride = 4; break;
-            case RGB32F: stride = 12; break;
-            case RGBA32F: stride = 16; break;
-        }
+    //In LAZY mode only the headers are parsed on construction, pixels are decoded
+    //on demand by get_pixel and get_row, and get_data decodes the whole image.
+    //image_index selects the image of an OS/2 bitmap array, see get_images.
+    //collect_stats gathers bmp_stats while the full pixel array is decoded
+    bmp_reader(const std::string& _path, pformat _pixel_format, load_mode _mode, size_t _image_index, bool _collect_stats) : path(_path), pixel_format(_pixel_format), mode(_mode), image_index(_image_index), collect_stats(_collect_stats) {
+        stride = pformat_stride(pixel_format);
         load_image();
     }
 
+    bmp_reader(const std::string& _path, pformat _pixel_format, load_mode _mode, size_t _image_index) : bmp_reader(_path, _pixel_format, _mode, _image_index, false) {}
+
+    bmp_reader(const std::string& _path, pformat _pixel_format, load_mode _mode) : bmp_reader(_path, _pixel_format, _mode, 0) {}
+
+    bmp_reader(const std::string& _path, pformat _pixel_format) : bmp_reader(_path, _pixel_format, load_mode::EAGER) {}
+
     bmp_reader(const std::string& _path) : bmp_reader(_path, pformat::RGBA) {}
 
     void output_to_ppm(std::ostream &out){
+        if(loaded && !decoded){
+            get_data();
+        }
         if(loaded){
             std::stringstream str;
             str << "P3\n" << width << ' ' << height << "\n256\n";
@@ -111,12 +279,152 @@ public:
     }
 
     uint8_t* get_data(){
+        if(loaded && !decoded){
+            //Lazy readers only decode the full pixel array once it is requested
+            loaded = decode_pixels(file_buffer.get());
+            row_cache.clear();
+            //Every pixel is in pixel_map now
+            file_buffer.reset();
+        }
         return pixel_map;
     }
 
+    //Returns a pointer to row y (counted from the top) in the selected pixel format.
+    //Lazy readers decode the row block containing y into a small cache,
+    //so the pointer is only valid until the next call to get_row
+    const uint8_t* get_row(int y){
+        if(!loaded || y < 0 || y >= height){
+            std::cerr << "Invalid row: " << y << '\n';
+            return nullptr;
+        }
+        if(!decoded && rle_compressed()){
+            //Run length encoded rows can't be addressed directly
+            get_data();
+            if(!decoded){
+                return nullptr;
+            }
+        }
+        if(decoded){
+            return pixel_map + static_cast<uint64_t>(y)*width*stride;
+        }
+        int first_row = y - y % LAZY_ROW_BLOCK_HEIGHT;
+        row_block* block = nullptr;
+        for(row_block& cached : row_cache){
+            if(cached.first_row == first_row){
+                block = &cached;
+                break;
+            }
+        }
+        if(!block){
+            block = load_row_block(first_row);
+            if(!block){
+                return nullptr;
+            }
+        }
+        block->last_used = ++row_cache_clock;
+        return block->pixels.data() + static_cast<uint64_t>(y - first_row)*width*stride;
+    }
+
+    //Returns the pixel at column x of row y (counted from the top).
+    //Lazy readers decode it straight from the file without touching the row cache
+    RGB_color get_pixel(int x, int y){
+        if(!loaded || x < 0 || x >= width || y < 0 || y >= height){
+            std::cerr << "Invalid pixel: " << x << ", " << y << '\n';
+            return RGB_color();
+        }
+        if(!decoded && !rle_compressed()){
+            int file_row = topdown ? y : height - 1 - y;
+            if(!row_in_file(file_row)){
+                return RGB_color();
+            }
+            return sample_pixel(file_buffer.get(), x, file_row);
+        }
+        const uint8_t* row = get_row(y);
+        if(!row){
+            return RGB_color();
+        }
+        return read_pixel(row + x*stride);
+    }
+
+    //Lists the images stored in the file without decoding them
+    const std::vector<bmp_image_info>& get_images(){
+        return images;
+    }
+
+    //Decodes the selected images on up to hardware_concurrency threads,
+    //sharing the file buffer between them
+    std::vector<bmp_reader> decode_images(const std::vector<size_t>& indices){
+        std::vector<bmp_reader> readers;
+        std::shared_ptr<char> buffer = file_buffer;
+        if(!buffer){
+            buffer = read_file();
+            if(!buffer){
+                return readers;
+            }
+        }
+        for(size_t index : indices){
+            readers.push_back(bmp_reader(path, pixel_format, buffer, file_size, index, collect_stats));
+        }
+        std::atomic<size_t> next_reader(0);
+        auto worker = [&readers, &next_reader]{
+            for(size_t i = next_reader++; i < readers.size(); i = next_reader++){
+                readers[i].get_data();
+            }
+        };
+        size_t worker_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), readers.size());
+        std::vector<std::thread> threads;
+        threads.reserve(worker_count);
+        try{
+            //The calling thread is one of the workers
+            for(size_t i = 1; i < worker_count; i++){
+                threads.emplace_back(worker);
+            }
+            worker();
+        }
+        catch(const std::system_error& e){
+            //Whatever is left is decoded by the calling thread
+            std::cerr << "Could not start decoding thread: " << e.what() << '\n';
+            join_threads(threads);
+            worker();
+        }
+        catch(...){
+            join_threads(threads);
+            throw;
+        }
+        join_threads(threads);
+        return readers;
+    }
+
+    //Statistics of the decoded image, nullptr when collect_stats wasn't set
+    //or the image failed to load. Lazy readers decode the whole image first
+    const bmp_stats* get_stats(){
+        if(!collect_stats){
+            return nullptr;
+        }
+        if(loaded && !decoded){
+            get_data();
+        }
+        if(!decoded){
+            return nullptr;
+        }
+        return &stats;
+    }
+
+    static void join_threads(std::vector<std::thread>& threads){
+        for(std::thread& thread : threads){
+            if(thread.joinable()){
+                thread.join();
+            }
+        }
+    }
 
     void free_data(){
         free(pixel_map);
+        pixel_map = nullptr;
+        file_buffer.reset();
+        row_cache.clear();
+        loaded = false;
+        decoded = false;
     }
 
     int get_width(){
@@ -137,10 +445,20 @@ public:
         pixel_map = reversed;
     }
 private:
+    //Decodes an image out of a file buffer that has already been read
+    bmp_reader(const std::string& _path, pformat _pixel_format, std::shared_ptr<char> _file_buffer, uint64_t _file_size, size_t _image_index, bool _collect_stats)
+        : path(_path), file_size(_file_size), file_buffer(_file_buffer), pixel_format(_pixel_format), mode(load_mode::LAZY), image_index(_image_index), collect_stats(_collect_stats) {
+        stride = pformat_stride(pixel_format);
+        load_buffer();
+    }
+
     std::string path;
     int width, height;
     uint64_t file_size;
-    uint8_t* pixel_map;
+    //Memory mapped on POSIX systems and read into the heap elsewhere,
+    //only kept by lazy readers until the full pixel array has been decoded
+    std::shared_ptr<char> file_buffer;
+    uint8_t* pixel_map = nullptr;
     uint64_t pixel_map_size;
     uint64_t pixel_map_position;
     std::vector<RGB_color> color_table;
@@ -149,9 +467,12 @@ private:
     uint32_t compression_method;
     uint32_t color_pallete_colors;
     uint32_t DIB_header_size;
+    uint32_t header_offset = 0;
+    int palette_entry_size = 4;
     uint32_t size_in_bytes;
     uint16_t bits_per_pixel;
     uint32_t calculated_image_data_size;
+    int row_size;
 
     //Used for 32 and 16 bit sampled images
     uint32_t r_mask;
@@ -160,12 +481,42 @@ private:
     uint8_t g_shift;
     uint32_t b_mask;
     uint8_t b_shift;
+    //Only set by alpha bitfields and V3 or later headers
+    uint32_t a_mask = 0;
+    uint8_t a_shift = 0;
+    //Used for 16 bit sampled images
+    int r_shiftback;
+    int g_shiftback;
+    int b_shiftback;
 
     bool loaded = false;
+    bool decoded = false;
     bool topdown = false;
 
     pformat pixel_format = RGBA;
     int stride = 4;
+    load_mode mode = EAGER;
+
+    std::vector<bmp_image_info> images;
+    size_t image_index = 0;
+
+    //Gathered by insert_pixel, rows arrive in file order so
+    //their hashes are only combined once the image is complete
+    bool collect_stats = false;
+    bmp_stats stats;
+    xxh64_stream row_hasher = xxh64_stream(0);
+    std::vector<uint64_t> row_hashes;
+    int stats_row = 0;
+    int stats_row_pixels = 0;
+
+    //Recently decoded rows of a lazy reader
+    struct row_block{
+        int first_row;
+        uint64_t last_used;
+        std::vector<uint8_t> pixels;
+    };
+    std::vector<row_block> row_cache;
+    uint64_t row_cache_clock = 0;
 
    int insert_count = 0;
 
@@ -176,11 +527,26 @@ private:
     }
 
     void load_image() {
+        file_buffer = read_file();
+        if(file_buffer){
+            load_buffer();
+        }
+    }
+
+    //Maps the file into memory where the platform supports it,
+    //otherwise reads it into a heap buffer
+    std::shared_ptr<char> read_file(){
+#ifdef BMP_READER_MMAP
+        std::shared_ptr<char> mapped_buffer = map_file();
+        if(mapped_buffer){
+            return mapped_buffer;
+        }
+#endif
         std::ifstream img_file(path, std::ios::binary);
 
         if(!img_file.is_open()){
             std::cerr << "Error opening file: " << path << '\n';
-            return;
+            return nullptr;
         }
 
         img_file.seekg(0, std::ios::end);
@@ -188,46 +554,222 @@ private:
         img_file.seekg(0, std::ios::beg);
 
         char* buffer = (char*)malloc(file_size);
+        std::shared_ptr<char> shared_buffer(buffer, free);
 
         img_file.read(buffer, file_size);
         img_file.close();
+        return shared_buffer;
+    }
+
+#ifdef BMP_READER_MMAP
+    std::shared_ptr<char> map_file(){
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0){
+            return nullptr;
+        }
+        struct stat file_stat;
+        if(fstat(fd, &file_stat) != 0 || file_stat.st_size <= 0){
+            close(fd);
+            return nullptr;
+        }
+        size_t mapping_size = file_stat.st_size;
+        void* mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(mapping == MAP_FAILED){
+            return nullptr;
+        }
+        file_size = mapping_size;
+        return std::shared_ptr<char>(static_cast<char*>(mapping), [mapping_size](char* p){
+            munmap(p, mapping_size);
+        });
+    }
+#endif
+
+    void load_buffer(){
+        char* buffer = file_buffer.get();
+        if(file_size < BITMAP_HEADER_SIZE){
+            std::cerr << "File too small: " << file_size << '\n';
+            file_buffer.reset();
+            return;
+        }
 
         std::string MB(buffer, 2);
 
         //Magic Byte check
-        if (MB != "BM"
-            && MB != "BA"
-            && MB != "CI"
-            && MB != "CP"
-            && MB != "IC"
-            && MB != "PT"
-        ){
+        if (MB != "BA" && !image_signature(MB)){
             std::cerr << "Invalid File Signature: " << MB << '\n';
-            free(buffer);
-            free(pixel_map);
+            file_buffer.reset();
             return;
         }
-        std::copy(&(buffer[DIB_HEADER_SIZE_OFFSET]), &(buffer[DIB_HEADER_SIZE_OFFSET]) + sizeof(uint32_t), reinterpret_cast<char*>(&DIB_header_size));
-        std::clog << "Header Size: " << DIB_header_size <<'\n';
 
-        if(DIB_header_size == DIB_BITMAPINFOHEADER
-            || DIB_header_size == DIB_BITMAPV2HEADER
-            || DIB_header_size == DIB_BITMAPV3HEADER
-            || DIB_header_size == DIB_BITMAPV4HEADER
-            || DIB_header_size == DIB_BITMAPV4HEADER){
-            loaded = load_BITMAPINFOHEADER(buffer);
-        } else{
-            std::clog << "Unsupported bitmap\n";
+        if(!get_image_list(buffer)){
+            images.clear();
             loaded = false;
         }
+        else if(image_index >= images.size()){
+            std::cerr << "Invalid image index: " << image_index << " When count: " << images.size() << '\n';
+            loaded = false;
+        }
+        else{
+            header_offset = images[image_index].header_offset;
+            DIB_header_size = images[image_index].DIB_header_size;
+            std::clog << "Header Size: " << DIB_header_size <<'\n';
+            loaded = load_BITMAPINFOHEADER(buffer);
+        }
         std::clog << insert_count << '\n';
-        free(buffer);
+        if(mode == EAGER || !loaded){
+            file_buffer.reset();
+        }
+    }
+
+    bool image_signature(const std::string& type){
+        return type == "BM"
+            || type == "CI"
+            || type == "CP"
+            || type == "IC"
+            || type == "PT";
+    }
+
+    bool supported_DIB_header(uint32_t size){
+        return size == DIB_BITMAPCOREHEADER
+            || size == DIB_OS22XBITMAPHEADER_SMALL
+            || size == DIB_OS22XBITMAPHEADER
+            || size == DIB_BITMAPINFOHEADER
+            || size == DIB_BITMAPV2HEADER
+            || size == DIB_BITMAPV3HEADER
+            || size == DIB_BITMAPV4HEADER
+            || size == DIB_BITMAPV5HEADER;
+    }
+
+    bool os2_DIB_header(){
+        return DIB_header_size == DIB_BITMAPCOREHEADER
+            || DIB_header_size == DIB_OS22XBITMAPHEADER_SMALL
+            || DIB_header_size == DIB_OS22XBITMAPHEADER;
+    }
+
+    //Walks the chain of OS/2 bitmap array headers without decoding any pixels,
+    //any other file holds a single image
+    bool get_image_list(const char* buffer){
+        images.clear();
+        if(std::string(buffer, 2) != "BA"){
+            return add_image(buffer, 0, 0, 0);
+        }
+        uint64_t array_offset = 0;
+        while(true){
+            if(images.size() == BITMAP_ARRAY_MAX_IMAGES){
+                std::cerr << "Bitmap array holds more than " << BITMAP_ARRAY_MAX_IMAGES << " images" << '\n';
+                return false;
+            }
+            if(array_offset + BITMAP_ARRAY_HEADER_SIZE > file_size || std::string(&(buffer[array_offset]), 2) != "BA"){
+                std::cerr << "Invalid bitmap array header at: " << array_offset << '\n';
+                return false;
+            }
+            uint32_t next_offset = read_field<uint32_t>(buffer, array_offset + BITMAP_ARRAY_NEXT_OFFSET);
+            uint16_t display_width = read_field<uint16_t>(buffer, array_offset + BITMAP_ARRAY_DISPLAY_WIDTH_OFFSET);
+            uint16_t display_height = read_field<uint16_t>(buffer, array_offset + BITMAP_ARRAY_DISPLAY_HEIGHT_OFFSET);
+            if(!add_image(buffer, array_offset + BITMAP_ARRAY_HEADER_SIZE, display_width, display_height)){
+                return false;
+            }
+            if(next_offset == 0){
+                break;
+            }
+            if(next_offset <= array_offset){
+                std::cerr << "Bitmap array points backwards to: " << next_offset << '\n';
+                return false;
+            }
+            array_offset = next_offset;
+        }
+        std::clog << "Images: " << images.size() << '\n';
+        return true;
+    }
+
+    bool add_image(const char* buffer, uint64_t offset, uint16_t display_width, uint16_t display_height){
+        bmp_image_info info;
+        if(!read_image_info(buffer, offset, info)){
+            return false;
+        }
+        if(info.type == "CI" || info.type == "CP"){
+            //Color icons and pointers store the monochrome mask first, directly followed by the color bitmap
+            int entry_size = (info.DIB_header_size == DIB_BITMAPCOREHEADER) ? 3 : 4;
+            offset += BITMAP_HEADER_SIZE + info.DIB_header_size + info.color_pallete_colors*entry_size;
+            if(!read_image_info(buffer, offset, info)){
+                return false;
+            }
+        }
+        info.display_width = display_width;
+        info.display_height = display_height;
+        images.push_back(info);
+        return true;
+    }
+
+    bool read_image_info(const char* buffer, uint64_t offset, bmp_image_info& info){
+        if(offset + BITMAP_HEADER_SIZE + sizeof(uint32_t) > file_size){
+            std::cerr << "Truncated bitmap header at: " << offset << '\n';
+            return false;
+        }
+        info.type = std::string(&(buffer[offset]), 2);
+        if(!image_signature(info.type)){
+            std::cerr << "Invalid Image Signature: " << info.type << " at: " << offset << '\n';
+            return false;
+        }
+        info.header_offset = offset;
+        info.DIB_header_size = read_field<uint32_t>(buffer, offset + DIB_HEADER_SIZE_OFFSET);
+        if(!supported_DIB_header(info.DIB_header_size)){
+            std::clog << "Unsupported bitmap\n";
+            return false;
+        }
+        if(offset + BITMAP_HEADER_SIZE + info.DIB_header_size > file_size){
+            std::cerr << "Truncated bitmap header at: " << offset << '\n';
+            return false;
+        }
+        info.image_data_offset = read_field<uint32_t>(buffer, offset + IMAGE_DATA_OFFSET_OFFSET);
+        info.topdown = false;
+        info.color_pallete_colors = 0;
+        if(info.DIB_header_size == DIB_BITMAPCOREHEADER){
+            //OS/2 1.x headers store unsigned 16 bit dimensions
+            info.width = read_field<uint16_t>(buffer, offset + CORE_WIDTH_OFFSET);
+            info.height = read_field<uint16_t>(buffer, offset + CORE_HEIGHT_OFFSET);
+            info.bits_per_pixel = read_field<uint16_t>(buffer, offset + CORE_BITS_PER_PIXEL_OFFSET);
+        }
+        else{
+            info.width = read_field<int32_t>(buffer, offset + WIDTH_OFFSET);
+            info.height = read_field<int32_t>(buffer, offset + HEIGHT_OFFSET);
+            info.bits_per_pixel = read_field<uint16_t>(buffer, offset + BITS_PER_PIXEL_OFFSET);
+            if(info.DIB_header_size > DIB_OS22XBITMAPHEADER_SMALL){
+                info.color_pallete_colors = read_field<uint32_t>(buffer, offset + COLOR_PALLETE_OFFSET);
+            }
+        }
+        if(info.height < 0){
+            info.height = abs(info.height);
+            info.topdown = true;
+        }
+        if(info.color_pallete_colors == 0 && info.bits_per_pixel <= 8){
+            //No color count means the palette holds every color of the depth
+            info.color_pallete_colors = 1 << info.bits_per_pixel;
+        }
+        return true;
     }
 
     bool load_BITMAPINFOHEADER(char* buffer){
         get_header_data(buffer);
+        if(os2_DIB_header()
+            && compression_method != BI_RGB
+            && compression_method != BI_RLE8
+            && compression_method != BI_RLE4){
+            //OS/2 uses 3 and 4 for Huffman 1D and RLE24 instead of bitfields and JPEG
+            std::clog << "Unsupported compression" << '\n';
+            return false;
+        }
         calculated_image_data_size = file_size - image_data_offset;
-        pixel_map_size = width*height*stride;
+        row_size = static_cast<int>(ceil((bits_per_pixel * width)/32.0))  * 4;
+        if(mode == LAZY){
+            return prepare_sampling(buffer);
+        }
+        return decode_pixels(buffer);
+    }
+
+    bool decode_pixels(char* buffer){
+        pixel_map_size = static_cast<uint64_t>(width)*height*stride;
         std::clog << "Size: " << pixel_map_size * sizeof(uint8_t)<< '\n';
         pixel_map = (uint8_t*)malloc(pixel_map_size * sizeof(uint8_t));
         if(!pixel_map){
@@ -235,12 +777,18 @@ private:
             return false;
         }
         pixel_map_position = 0;
+        if(collect_stats){
+            start_stats();
+        }
         std::clog << "Calculated Image Data Size: " << calculated_image_data_size <<'\n';
         bool ret = true;
         if(abs(height) > 32727 || height == 0||width > 32727 || width <=0){
             std::clog << "Invalid image dimensions" << '\n';
             ret = false;
         }
+        else if(!pixel_array_in_file()){
+            ret = false;
+        }
         else if(bits_per_pixel == 32){
             ret = read_32bit(buffer);
         }
@@ -266,12 +814,215 @@ private:
         if(!topdown && ret){
             reverse_rows();
         }
+        if(collect_stats && ret){
+            finish_stats();
+        }
+        if(!ret){
+            free(pixel_map);
+            pixel_map = nullptr;
+        }
+        decoded = ret;
         return ret;
     }
 
+    void start_stats(){
+        stats = bmp_stats();
+        row_hasher.reset();
+        row_hashes.assign(height, 0);
+        stats_row = 0;
+        stats_row_pixels = 0;
+    }
+
+    //Called for every pixel while it is being decoded
+    void add_to_stats(RGB_color c){
+        stats.histogram[0][c.r]++;
+        stats.histogram[1][c.g]++;
+        stats.histogram[2][c.b]++;
+        stats.histogram[3][c.a]++;
+        row_hasher.update(c.r | (c.g << 8) | (c.b << 16) | (static_cast<uint32_t>(c.a) << 24));
+        if(++stats_row_pixels == width){
+            finish_stats_row();
+        }
+    }
+
+    void finish_stats_row(){
+        if(stats_row < height){
+            row_hashes[topdown ? stats_row : height - 1 - stats_row] = row_hasher.digest();
+        }
+        row_hasher.reset();
+        stats_row++;
+        stats_row_pixels = 0;
+    }
+
+    //Derives everything else from the histograms, without reading the pixel array
+    void finish_stats(){
+        if(stats_row_pixels > 0){
+            //Run length encoded images can end mid row
+            finish_stats_row();
+        }
+        xxh64_stream image_hasher((static_cast<uint64_t>(width) << 32) | static_cast<uint32_t>(height));
+        for(uint64_t row_hash : row_hashes){
+            image_hasher.update(static_cast<uint32_t>(row_hash));
+            image_hasher.update(static_cast<uint32_t>(row_hash >> 32));
+        }
+        stats.hash = image_hasher.digest();
+        row_hashes.clear();
+
+        uint64_t count = 0;
+        for(int v = 0; v < 256; v++){
+            count += stats.histogram[0][v];
+        }
+        for(int ch = 0; ch < 4; ch++){
+            uint64_t sum = 0;
+            bool found_min = false;
+            for(int v = 0; v < 256; v++){
+                uint64_t n = stats.histogram[ch][v];
+                if(n == 0){
+                    continue;
+                }
+                if(!found_min){
+                    stats.min[ch] = v;
+                    found_min = true;
+                }
+                stats.max[ch] = v;
+                sum += n * v;
+            }
+            stats.mean[ch] = count ? static_cast<double>(sum) / count : 0.0;
+        }
+        stats.opaque = count && stats.histogram[3][255] == count;
+        stats.transparent = count && stats.histogram[3][0] == count;
+    }
+
+    //Reads the palette or bitfields needed to decode single pixels,
+    //leaving the pixel array itself untouched
+    bool prepare_sampling(char* buffer){
+        if(abs(height) > 32727 || height == 0||width > 32727 || width <=0){
+            std::clog << "Invalid image dimensions" << '\n';
+            return false;
+        }
+        if(rle_compressed()){
+            //Decoded in full on first access
+            return get_color_table_info(buffer);
+        }
+        if(bits_per_pixel == 32){
+            return get_bitfield_mask(buffer);
+        }
+        else if(bits_per_pixel == 16){
+            if(!get_bitfield_mask(buffer)){
+                return false;
+            }
+            get_bitfield_shiftback();
+        }
+        else if(bits_per_pixel == 8 || bits_per_pixel == 4 || bits_per_pixel == 1){
+            return get_color_table_info(buffer);
+        }
+        else if(bits_per_pixel != 24){
+            std::clog << "Unsupported color depth" << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    bool rle_compressed(){
+        return (bits_per_pixel == 8 && compression_method == BI_RLE8)
+            || (bits_per_pixel == 4 && compression_method == BI_RLE4);
+    }
+
+    //Checked before any read_* indexes into the pixel array
+    bool pixel_array_in_file(){
+        uint64_t pixel_array_size = rle_compressed() ? size_in_bytes : static_cast<uint64_t>(row_size)*height;
+        if(image_data_offset + pixel_array_size > file_size){
+            std::cerr << "Pixel array exceeds the file" << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    bool row_in_file(int file_row){
+        if(image_data_offset + static_cast<uint64_t>(file_row + 1)*row_size > file_size){
+            std::cerr << "Row " << file_row << " lies outside of the file" << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    //Decodes a single pixel of an uncompressed image,
+    //file_row is counted in the order the rows are stored in the file
+    RGB_color sample_pixel(const char* buffer, int x, int file_row){
+        uint64_t row_offset = image_data_offset + static_cast<uint64_t>(file_row)*row_size;
+        if(bits_per_pixel == 32){
+            uint32_t ddword;
+            std::copy(&(buffer[row_offset + x*4]), &(buffer[row_offset + x*4]) + sizeof(uint32_t), reinterpret_cast<char*>(&ddword));
+            uint8_t b = (ddword & b_mask) >> b_shift;
+            uint8_t g = (ddword & g_mask) >> g_shift;
+            uint8_t r = (ddword & r_mask) >> r_shift;
+            uint8_t a = decode_32bit_alpha(ddword);
+            return RGB_color(r, g, b, a);
+        }
+        else if(bits_per_pixel == 24){
+            uint64_t offset = row_offset + x*3;
+            return RGB_color(buffer[offset + 2], buffer[offset + 1], buffer[offset]);
+        }
+        else if(bits_per_pixel == 16){
+            uint16_t word;
+            std::copy(&(buffer[row_offset + x*2]), &(buffer[row_offset + x*2]) + sizeof(uint16_t), reinterpret_cast<char*>(&word));
+            return decode_16bit(word);
+        }
+        else if(bits_per_pixel == 8){
+            uint8_t color_idx = buffer[row_offset + x];
+            return color_table[color_idx];
+        }
+        else if(bits_per_pixel == 4){
+            uint8_t value = buffer[row_offset + x/2];
+            int color_idx = (x%2 == 0) ? (value & 0xF0) >> 4 : (value & 0x0F);
+            return color_table[color_idx];
+        }
+        else{
+            uint8_t value = buffer[row_offset + x/8];
+            int color_idx = (value >> (7 - x%8)) & 0x01;
+            return color_table[color_idx];
+        }
+    }
+
+    //Decodes LAZY_ROW_BLOCK_HEIGHT rows starting at first_row into the row cache,
+    //evicting the least recently used block once the cache is full
+    row_block* load_row_block(int first_row){
+        int rows = std::min(LAZY_ROW_BLOCK_HEIGHT, height - first_row);
+        for(int i = 0; i < rows; i++){
+            if(!row_in_file(topdown ? first_row + i : height - 1 - first_row - i)){
+                return nullptr;
+            }
+        }
+        row_block* block;
+        if(row_cache.size() < LAZY_ROW_BLOCK_CACHE_SIZE){
+            row_cache.push_back(row_block());
+            block = &row_cache.back();
+        }
+        else{
+            block = &row_cache[0];
+            for(row_block& cached : row_cache){
+                if(cached.last_used < block->last_used){
+                    block = &cached;
+                }
+            }
+        }
+        block->first_row = first_row;
+        block->pixels.resize(static_cast<uint64_t>(rows)*width*stride);
+        uint8_t* dst = block->pixels.data();
+        for(int i = 0; i < rows; i++){
+            int file_row = topdown ? first_row + i : height - 1 - first_row - i;
+            for(int j = 0; j < width; j++){
+                write_pixel(dst, sample_pixel(file_buffer.get(), j, file_row));
+                dst += stride;
+            }
+        }
+        return block;
+    }
+
     bool read_32bit(char* buffer){
-        get_bitfield_mask(buffer);
-        int row_size = static_cast<int>(ceil((bits_per_pixel * width)/32.0))  * 4;
+        if(!get_bitfield_mask(buffer)){
+            return false;
+        }
         for(int i = 0; i < abs(height); i++){
             for(int j = 0; j < width*4 ; j+=4){
                 int offset = image_data_offset + i*row_size + j;
@@ -280,7 +1031,7 @@ private:
                 uint8_t b = (ddword & b_mask) >> b_shift;
                 uint8_t g = (ddword & g_mask) >> g_shift;
                 uint8_t r = (ddword & r_mask) >> r_shift;
-                uint8_t a = (ddword & (~(r_mask|b_mask|g_mask))) >> 24; //This doesn't work
+                uint8_t a = decode_32bit_alpha(ddword);
                 insert_pixel(RGB_color(r, g, b, a));
             }
         }
@@ -288,7 +1039,6 @@ private:
     }
 
     bool read_24bit(char* buffer){
-        int row_size = static_cast<int>(ceil((bits_per_pixel * width)/32.0))  * 4;
         for(int i = 0; i < abs(height); i++){
             for(int j = 0; j < width*3 ; j+=3){
                 int offset = image_data_offset + i*row_size + j;
@@ -302,38 +1052,40 @@ private:
     }
 
     bool read_16bit(char* buffer){
-        get_bitfield_mask(buffer);
-
-        int b_shiftback = 8 - std::bitset<8>(b_mask>>b_shift).count();
-        int g_shiftback = 8 - std::bitset<8>(g_mask>>g_shift).count();
-        int r_shiftback = 8 - std::bitset<8>(r_mask>>r_shift).count();
+        if(!get_bitfield_mask(buffer)){
+            return false;
+        }
+        get_bitfield_shiftback();
 
-        int row_size = static_cast<int>(ceil((bits_per_pixel * width)/32.0))  * 4;
         for(int i = 0; i < abs(height); i++){
             for(int j = 0; j < width*2 ; j+=2){
                 int offset = image_data_offset + i*row_size + j;
                 uint16_t word;
                 std::copy(&(buffer[offset]), &(buffer[offset]) + sizeof(uint16_t), reinterpret_cast<char*>(&word));
-                uint8_t b = ((word & b_mask) >> b_shift) << b_shiftback;
-                uint8_t g = ((word & g_mask) >> g_shift) << g_shiftback;
-                uint8_t r = ((word & r_mask) >> r_shift) << r_shiftback;
-
-                if((b == (((b_mask >> b_shift) << b_shiftback)) &&
-                    (g == ((g_mask >> g_shift) << g_shiftback)) &&
-                    (r == ((r_mask >> r_shift) << r_shiftback)))){
-                    //Convert maximum RBG values to pure white
-                    //ie for default 16 bit RBG555 the maximum value is (248,248,248)
-                    //which gets converted to (255,255,255)
-                    r = 255;
-                    b = 255;
-                    g = 255;
-                }
-               insert_pixel(RGB_color(r, g, b));
+                insert_pixel(decode_16bit(word));
             }
         }
         return true;
     }
 
+    RGB_color decode_16bit(uint16_t word){
+        uint8_t b = ((word & b_mask) >> b_shift) << b_shiftback;
+        uint8_t g = ((word & g_mask) >> g_shift) << g_shiftback;
+        uint8_t r = ((word & r_mask) >> r_shift) << r_shiftback;
+
+        if((b == (((b_mask >> b_shift) << b_shiftback)) &&
+            (g == ((g_mask >> g_shift) << g_shiftback)) &&
+            (r == ((r_mask >> r_shift) << r_shiftback)))){
+            //Convert maximum RBG values to pure white
+            //ie for default 16 bit RBG555 the maximum value is (248,248,248)
+            //which gets converted to (255,255,255)
+            r = 255;
+            b = 255;
+            g = 255;
+        }
+        return RGB_color(r, g, b);
+    }
+
     bool read_8bit(char* buffer){
         if(!get_color_table_info(buffer)){
             return false;
@@ -348,7 +1100,6 @@ private:
     }
 
     bool read_8bit_standard(char* buffer){
-        int row_size = static_cast<int>(ceil((bits_per_pixel * width)/32.0))  * 4;
         for(int i = 0; i < abs(height); i++){
             for(int j = 0; j < width ; j++){
                 int offset = image_data_offset + i*row_size + j;
@@ -373,13 +1124,11 @@ private:
     }
 
     bool read_4bit_standard(char* buffer){
-        int row_size = static_cast<int>(ceil((bits_per_pixel * width)/32.0))  * 4;
         for(int i = 0; i < abs(height); i++){
             int current_row_pixel_position = 0;
             for(int j = 0; current_row_pixel_position < width ; j++){
                 int offset = image_data_offset + (i*row_size) + j;
-                uint16_t value;
-                std::copy(&(buffer[offset]), &(buffer[offset]) + sizeof(uint16_t), reinterpret_cast<char*>(&value));
+                uint8_t value = buffer[offset];
                 int color_idx = (value & 0xF0) >> 4;
                 insert_pixel(RGB_color(color_table[color_idx]));
                 current_row_pixel_position++;
@@ -397,7 +1146,6 @@ private:
         if(!get_color_table_info(buffer)){
             return false;
         }
-        int row_size = static_cast<int>(ceil((bits_per_pixel * width)/32.0))  * 4;
         for(int i = 0; i < abs(height); i++){
             int current_row_pixel_position = 0;
             for(int j = 0; current_row_pixel_position < width ; j++){
@@ -592,8 +1340,13 @@ private:
             compression_additional_offset = 16;
         }
 
-        int color_table_offset = DIB_header_size + DIB_HEADER_SIZE_OFFSET + compression_additional_offset;
-        for(uint32_t i = 0; i< color_pallete_colors*4; i+=4){
+        uint64_t color_table_offset = header_offset + DIB_header_size + DIB_HEADER_SIZE_OFFSET + compression_additional_offset;
+        if(color_table_offset + color_pallete_colors*palette_entry_size > file_size){
+            std::cerr << "Color table exceeds the file" << '\n';
+            return false;
+        }
+        color_table.clear();
+        for(uint32_t i = 0; i< color_pallete_colors*palette_entry_size; i+=palette_entry_size){
             uint8_t b = buffer[color_table_offset+i];
             uint8_t g = buffer[color_table_offset+i+1];
             uint8_t r = buffer[color_table_offset+i+2];
@@ -606,17 +1359,28 @@ private:
 
     //Gets the masks which specify how the RGB colors are ordered
     //within the 32 bit unit which defines the pixel data
-    void get_bitfield_mask(char* buffer){
-        if(compression_method == BI_BITFIELDS){
-            int current_pos = 0;
-            std::copy(&(buffer[BITMAP_HEADER_SIZE + DIB_header_size + current_pos]), &(buffer[BITMAP_HEADER_SIZE + DIB_header_size + current_pos]) + sizeof(uint32_t), reinterpret_cast<char*>(&r_mask));
-            current_pos+=4;
-            std::copy(&(buffer[BITMAP_HEADER_SIZE + DIB_header_size + current_pos]), &(buffer[BITMAP_HEADER_SIZE + DIB_header_size + current_pos]) + sizeof(uint32_t), reinterpret_cast<char*>(&g_mask));
-            current_pos+=4;
-            std::copy(&(buffer[BITMAP_HEADER_SIZE + DIB_header_size + current_pos]), &(buffer[BITMAP_HEADER_SIZE + DIB_header_size + current_pos]) + sizeof(uint32_t), reinterpret_cast<char*>(&b_mask));
+    //The masks follow the 40 byte BITMAPINFOHEADER, later header versions
+    //carry them inside the header at the same position
+    bool get_bitfield_mask(char* buffer){
+        a_mask = 0;
+        a_shift = 0;
+        if(compression_method == BI_BITFIELDS || compression_method == BI_ALPHABITFIELDS){
+            bool has_alpha_mask = compression_method == BI_ALPHABITFIELDS || DIB_header_size >= DIB_BITMAPV3HEADER;
+            uint64_t masks_end = header_offset + (has_alpha_mask ? ALPHA_MASK_OFFSET : BITFIELD_MASKS_OFFSET + 8) + sizeof(uint32_t);
+            if(masks_end > file_size){
+                std::cerr << "Bitfield masks exceed the file" << '\n';
+                return false;
+            }
+            r_mask = read_field<uint32_t>(buffer, header_offset + BITFIELD_MASKS_OFFSET);
+            g_mask = read_field<uint32_t>(buffer, header_offset + BITFIELD_MASKS_OFFSET + 4);
+            b_mask = read_field<uint32_t>(buffer, header_offset + BITFIELD_MASKS_OFFSET + 8);
             r_shift = trailing_u32b_zeroes(r_mask);
             g_shift = trailing_u32b_zeroes(g_mask);
             b_shift = trailing_u32b_zeroes(b_mask);
+            if(has_alpha_mask){
+                a_mask = read_field<uint32_t>(buffer, header_offset + ALPHA_MASK_OFFSET);
+                a_shift = trailing_u32b_zeroes(a_mask);
+            }
         }
         else if(bits_per_pixel == 16){
             //Default colorspace for 16 bit is is RGB555
@@ -636,8 +1400,28 @@ private:
             b_mask = 0x000000ff;
             b_shift = 0;
         }
+        return true;
+    }
+
+    uint8_t decode_32bit_alpha(uint32_t ddword){
+        if(a_mask){
+            return (ddword & a_mask) >> a_shift;
+        }
+        return (ddword & (~(r_mask|b_mask|g_mask))) >> 24; //This doesn't work
+    }
 
+    //Gets how far the 16 bit color channels need to be shifted to fill a byte
+    void get_bitfield_shiftback(){
+        b_shiftback = 8 - std::bitset<8>(b_mask>>b_shift).count();
+        g_shiftback = 8 - std::bitset<8>(g_mask>>g_shift).count();
+        r_shiftback = 8 - std::bitset<8>(r_mask>>r_shift).count();
+    }
 
+    template<typename T>
+    T read_field(const char* buffer, uint64_t offset){
+        T value;
+        std::copy(&(buffer[offset]), &(buffer[offset]) + sizeof(T), reinterpret_cast<char*>(&value));
+        return value;
     }
 
     //Returns the number of trailing zeroes from a DDWORD sized primitive
@@ -657,18 +1441,22 @@ private:
     }
 
     void get_header_data(char* buffer) {
-        std::copy(&(buffer[WIDTH_OFFSET]), &(buffer[WIDTH_OFFSET]) + sizeof(int), reinterpret_cast<char*>(&width));
-        std::copy(&(buffer[HEIGHT_OFFSET]), &(buffer[HEIGHT_OFFSET]) + sizeof(int), reinterpret_cast<char*>(&height));
-        std::copy(&(buffer[BITS_PER_PIXEL_OFFSET]), &(buffer[BITS_PER_PIXEL_OFFSET]) + sizeof(uint16_t), reinterpret_cast<char*>(&bits_per_pixel));
-        std::copy(&(buffer[IMAGE_DATA_OFFSET_OFFSET]), &(buffer[IMAGE_DATA_OFFSET_OFFSET]) + sizeof(uint32_t), reinterpret_cast<char*>(&image_data_offset));
-        std::copy(&(buffer[COMPRESSION_METHOD_OFFSET]), &(buffer[COMPRESSION_METHOD_OFFSET]) + sizeof(uint32_t), reinterpret_cast<char*>(&compression_method));
-        std::copy(&(buffer[COLOR_PALLETE_OFFSET]), &(buffer[COLOR_PALLETE_OFFSET]) + sizeof(uint32_t), reinterpret_cast<char*>(&color_pallete_colors));
-        std::copy(&(buffer[PIXARAY_SIZE_OFFSET]), &(buffer[PIXARAY_SIZE_OFFSET]) + sizeof(uint32_t), reinterpret_cast<char*>(&size_in_bytes));
-
-        if(height < 0){
-            height = abs(height);
-            topdown = true;
+        const bmp_image_info& info = images[image_index];
+        width = info.width;
+        height = info.height;
+        topdown = info.topdown;
+        bits_per_pixel = info.bits_per_pixel;
+        image_data_offset = info.image_data_offset;
+        color_pallete_colors = info.color_pallete_colors;
+        palette_entry_size = (DIB_header_size == DIB_BITMAPCOREHEADER) ? 3 : 4;
+        compression_method = BI_RGB;
+        size_in_bytes = 0;
+        //Core and short OS/2 headers end before the compression fields
+        if(DIB_header_size > DIB_OS22XBITMAPHEADER_SMALL){
+            std::copy(&(buffer[header_offset + COMPRESSION_METHOD_OFFSET]), &(buffer[header_offset + COMPRESSION_METHOD_OFFSET]) + sizeof(uint32_t), reinterpret_cast<char*>(&compression_method));
+            std::copy(&(buffer[header_offset + PIXARAY_SIZE_OFFSET]), &(buffer[header_offset + PIXARAY_SIZE_OFFSET]) + sizeof(uint32_t), reinterpret_cast<char*>(&size_in_bytes));
         }
+
         std::clog << "Width: " << width << '\n';
         std::clog << "Height: " << height << '\n';
         std::clog << "Bits Per Pixel: " << bits_per_pixel << '\n';
@@ -683,28 +1471,35 @@ private:
         if(pixel_map_position+stride>pixel_map_size){
             std::cerr << "Inserting into invalid position " << pixel_map_position << " When max: " << pixel_map_size << '\n';
         }
-        else if(pixel_format == RGB){
-            pixel_map[pixel_map_position++] = c.r;
-            pixel_map[pixel_map_position++] = c.g;
-            pixel_map[pixel_map_position++] = c.b;
+        else{
+            write_pixel(&(pixel_map[pixel_map_position]), c);
+            pixel_map_position += stride;
+            if(collect_stats){
+                add_to_stats(c);
+            }
+        }
+    }
+
+    //Writes a single pixel in the selected pixel format
+    void write_pixel(uint8_t* dst, RGB_color c){
+        if(pixel_format == RGB){
+            dst[0] = c.r;
+            dst[1] = c.g;
+            dst[2] = c.b;
         }
         else if(pixel_format == RGBA){
-            //std::cerr << "Inserting into: " << pixel_map_position<< '\n';
-            pixel_map[pixel_map_position++] = c.r;
-            pixel_map[pixel_map_position++] = c.g;
-            pixel_map[pixel_map_position++] = c.b;
-            pixel_map[pixel_map_position++] = c.a;
+            dst[0] = c.r;
+            dst[1] = c.g;
+            dst[2] = c.b;
+            dst[3] = c.a;
         }
         else if(pixel_format == RGB32F){
             float r = inv_lerp(0, 255, c.r);
             float g = inv_lerp(0, 255, c.g);
             float b = inv_lerp(0, 255, c.b);
-            std::copy(&r, &r + 1, reinterpret_cast<float*>(&(pixel_map[pixel_map_position])));
-            pixel_map_position += sizeof(float);
-            std::copy(&g, &g + 1, reinterpret_cast<float*>(&(pixel_map[pixel_map_position])));
-            pixel_map_position += sizeof(float);
-            std::copy(&b, &b + 1, reinterpret_cast<float*>(&(pixel_map[pixel_map_position])));
-            pixel_map_position += sizeof(float);
+            std::copy(&r, &r + 1, reinterpret_cast<float*>(dst));
+            std::copy(&g, &g + 1, reinterpret_cast<float*>(dst + sizeof(float)));
+            std::copy(&b, &b + 1, reinterpret_cast<float*>(dst + 2*sizeof(float)));
             //std::clog << "Inserted color: " << r << ' ' << g << ' ' << b <<'\n';
             //std::clog <<  "Actual color: "  << c <<'\n';
         }
@@ -713,17 +1508,30 @@ private:
             float g = inv_lerp(0, 255, c.g);
             float b = inv_lerp(0, 255, c.b);
             float a = inv_lerp(0, 255, c.a);
-            std::copy(&r, &r + 1, reinterpret_cast<float*>(&(pixel_map[pixel_map_position])));
-            pixel_map_position += sizeof(float);
-            std::copy(&g, &g + 1, reinterpret_cast<float*>(&(pixel_map[pixel_map_position])));
-            pixel_map_position += sizeof(float);
-            std::copy(&b, &b + 1, reinterpret_cast<float*>(&(pixel_map[pixel_map_position])));
-            pixel_map_position += sizeof(float);
-            std::copy(&a, &a + 1, reinterpret_cast<float*>(&(pixel_map[pixel_map_position])));
-            pixel_map_position += sizeof(float);
+            std::copy(&r, &r + 1, reinterpret_cast<float*>(dst));
+            std::copy(&g, &g + 1, reinterpret_cast<float*>(dst + sizeof(float)));
+            std::copy(&b, &b + 1, reinterpret_cast<float*>(dst + 2*sizeof(float)));
+            std::copy(&a, &a + 1, reinterpret_cast<float*>(dst + 3*sizeof(float)));
         }
     }
 
+    //Reads back a single pixel written by write_pixel
+    RGB_color read_pixel(const uint8_t* src){
+        if(pixel_format == RGB){
+            return RGB_color(src[0], src[1], src[2]);
+        }
+        else if(pixel_format == RGBA){
+            return RGB_color(src[0], src[1], src[2], src[3]);
+        }
+        float channels[4] = {0, 0, 0, 1};
+        int channel_count = (pixel_format == RGBA32F) ? 4 : 3;
+        std::copy(src, src + channel_count*sizeof(float), reinterpret_cast<uint8_t*>(channels));
+        return RGB_color(lerp(0, 255, channels[0]) + 0.5f,
+                         lerp(0, 255, channels[1]) + 0.5f,
+                         lerp(0, 255, channels[2]) + 0.5f,
+                         lerp(0, 255, channels[3]) + 0.5f);
+    }
+
 
     float lerp(float a, float b, float f)
     {
@@ -736,3 +1544,422 @@ private:
         return (v-a) / (b-a);
     }
 };
+
+//The compile time reader relies on C++17 constexpr and if constexpr
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+
+//Header fields of an asset decoded at compile time
+struct bmp_static_info{
+    int width, height;
+    bool topdown;
+    uint16_t bits_per_pixel;
+    uint32_t compression_method;
+    uint32_t DIB_header_size;
+    uint32_t image_data_offset;
+    uint32_t color_pallete_colors;
+    uint32_t size_in_bytes;
+};
+
+//Decodes BMP assets embedded in the binary at compile time into the same layout get_data returns
+//  constexpr std::array<uint8_t, N> icon = {...};
+//  constexpr bmp_static_info icon_info = bmp_static_reader::header(icon);
+//  constexpr auto icon_pixels = bmp_static_reader::decode<icon_info.width, icon_info.height, RGBA>(icon);
+//Malformed assets fail to compile, float pixel formats need std::bit_cast from C++20
+class bmp_static_reader{
+public:
+    template<size_t N>
+    static constexpr bmp_static_info header(const std::array<uint8_t, N>& asset){
+        return header(asset.data(), N);
+    }
+
+    template<size_t N>
+    static constexpr bmp_static_info header(const uint8_t (&asset)[N]){
+        return header(asset, N);
+    }
+
+    static constexpr bmp_static_info header(const uint8_t* asset, size_t size){
+        if(size < BITMAP_HEADER_SIZE + sizeof(uint32_t)){
+            throw std::invalid_argument("Asset is too small to be a bitmap");
+        }
+        if(asset[0] != 'B' || asset[1] != 'M'){
+            throw std::invalid_argument("Only single image BM assets can be decoded at compile time");
+        }
+        bmp_static_info info{};
+        info.DIB_header_size = read_u32(asset, size, DIB_HEADER_SIZE_OFFSET);
+        bool core = info.DIB_header_size == DIB_BITMAPCOREHEADER;
+        bool os2 = core
+            || info.DIB_header_size == DIB_OS22XBITMAPHEADER_SMALL
+            || info.DIB_header_size == DIB_OS22XBITMAPHEADER;
+        if(!os2
+            && info.DIB_header_size != DIB_BITMAPINFOHEADER
+            && info.DIB_header_size != DIB_BITMAPV2HEADER
+            && info.DIB_header_size != DIB_BITMAPV3HEADER
+            && info.DIB_header_size != DIB_BITMAPV4HEADER
+            && info.DIB_header_size != DIB_BITMAPV5HEADER){
+            throw std::invalid_argument("Unsupported bitmap header");
+        }
+        if(BITMAP_HEADER_SIZE + info.DIB_header_size > size){
+            throw std::invalid_argument("Truncated bitmap header");
+        }
+        info.image_data_offset = read_u32(asset, size, IMAGE_DATA_OFFSET_OFFSET);
+        if(core){
+            info.width = read_u16(asset, size, CORE_WIDTH_OFFSET);
+            info.height = read_u16(asset, size, CORE_HEIGHT_OFFSET);
+            info.bits_per_pixel = read_u16(asset, size, CORE_BITS_PER_PIXEL_OFFSET);
+        }
+        else{
+            info.width = static_cast<int32_t>(read_u32(asset, size, WIDTH_OFFSET));
+            info.height = static_cast<int32_t>(read_u32(asset, size, HEIGHT_OFFSET));
+            info.bits_per_pixel = read_u16(asset, size, BITS_PER_PIXEL_OFFSET);
+        }
+        if(info.DIB_header_size > DIB_OS22XBITMAPHEADER_SMALL){
+            info.compression_method = read_u32(asset, size, COMPRESSION_METHOD_OFFSET);
+            info.size_in_bytes = read_u32(asset, size, PIXARAY_SIZE_OFFSET);
+            info.color_pallete_colors = read_u32(asset, size, COLOR_PALLETE_OFFSET);
+        }
+        bool rle = (info.bits_per_pixel == 8 && info.compression_method == BI_RLE8)
+            || (info.bits_per_pixel == 4 && info.compression_method == BI_RLE4);
+        //OS/2 uses 3 for Huffman 1D instead of bitfields
+        bool bitfields = !os2 && info.compression_method == BI_BITFIELDS
+            && (info.bits_per_pixel == 16 || info.bits_per_pixel == 32);
+        if(info.compression_method != BI_RGB && !rle && !bitfields){
+            throw std::invalid_argument("Unsupported compression");
+        }
+        if(info.height < 0){
+            info.height = -info.height;
+            info.topdown = true;
+        }
+        if(info.height > 32727 || info.height == 0 || info.width > 32727 || info.width <= 0){
+            throw std::invalid_argument("Invalid image dimensions");
+        }
+        if(info.color_pallete_colors == 0 && info.bits_per_pixel <= 8){
+            info.color_pallete_colors = 1 << info.bits_per_pixel;
+        }
+        if(info.color_pallete_colors > 256){
+            throw std::invalid_argument("Color table is too large");
+        }
+        return info;
+    }
+
+    template<int W, int H, pformat F, size_t N>
+    static constexpr std::array<uint8_t, static_cast<size_t>(W)*H*pformat_stride(F)> decode(const std::array<uint8_t, N>& asset){
+        return decode<W, H, F>(asset.data(), N);
+    }
+
+    template<int W, int H, pformat F, size_t N>
+    static constexpr std::array<uint8_t, static_cast<size_t>(W)*H*pformat_stride(F)> decode(const uint8_t (&asset)[N]){
+        return decode<W, H, F>(asset, N);
+    }
+
+    template<int W, int H, pformat F>
+    static constexpr std::array<uint8_t, static_cast<size_t>(W)*H*pformat_stride(F)> decode(const uint8_t* asset, size_t size){
+        static_assert(W > 0 && H > 0, "Asset dimensions must be positive");
+#ifndef __cpp_lib_bit_cast
+        static_assert(F == RGB || F == RGBA, "Float pixel formats need std::bit_cast to be decoded at compile time");
+#endif
+        bmp_static_info info = header(asset, size);
+        if(info.width != W || info.height != H){
+            throw std::invalid_argument("Asset dimensions don't match the requested size");
+        }
+        image<W, H, F> img{};
+        img.info = info;
+        img.row_size = ((info.bits_per_pixel * W + 31) / 32) * 4;
+        if(info.bits_per_pixel <= 8){
+            read_color_table(asset, size, img);
+        }
+        bool rle = (info.bits_per_pixel == 8 && info.compression_method == BI_RLE8)
+            || (info.bits_per_pixel == 4 && info.compression_method == BI_RLE4);
+        if(!rle && info.image_data_offset + static_cast<uint64_t>(img.row_size)*H > size){
+            throw std::invalid_argument("Pixel array exceeds the asset");
+        }
+
+        if(info.bits_per_pixel == 32){
+            read_bitfield_mask(asset, size, img);
+            for(int i = 0; i < H; i++){
+                for(int j = 0; j < W; j++){
+                    uint32_t ddword = read_u32(asset, size, info.image_data_offset + i*img.row_size + j*4);
+                    uint8_t b = (ddword & img.b_mask) >> img.b_shift;
+                    uint8_t g = (ddword & img.g_mask) >> img.g_shift;
+                    uint8_t r = (ddword & img.r_mask) >> img.r_shift;
+                    uint8_t a = img.a_mask ? (ddword & img.a_mask) >> img.a_shift
+                        : (ddword & (~(img.r_mask|img.b_mask|img.g_mask))) >> 24;
+                    insert_pixel(img, RGB_color(r, g, b, a));
+                }
+            }
+        }
+        else if(info.bits_per_pixel == 24){
+            for(int i = 0; i < H; i++){
+                for(int j = 0; j < W; j++){
+                    uint32_t offset = info.image_data_offset + i*img.row_size + j*3;
+                    insert_pixel(img, RGB_color(asset[offset + 2], asset[offset + 1], asset[offset]));
+                }
+            }
+        }
+        else if(info.bits_per_pixel == 16){
+            read_bitfield_mask(asset, size, img);
+            for(int i = 0; i < H; i++){
+                for(int j = 0; j < W; j++){
+                    uint16_t word = read_u16(asset, size, info.image_data_offset + i*img.row_size + j*2);
+                    uint8_t b = ((word & img.b_mask) >> img.b_shift) << img.b_shiftback;
+                    uint8_t g = ((word & img.g_mask) >> img.g_shift) << img.g_shiftback;
+                    uint8_t r = ((word & img.r_mask) >> img.r_shift) << img.r_shiftback;
+                    if((b == (((img.b_mask >> img.b_shift) << img.b_shiftback)) &&
+                        (g == ((img.g_mask >> img.g_shift) << img.g_shiftback)) &&
+                        (r == ((img.r_mask >> img.r_shift) << img.r_shiftback)))){
+                        //Maximum values are pure white, same as bmp_reader::read_16bit
+                        r = 255;
+                        g = 255;
+                        b = 255;
+                    }
+                    insert_pixel(img, RGB_color(r, g, b));
+                }
+            }
+        }
+        else if(info.bits_per_pixel == 8 && rle){
+            read_rle(asset, size, img);
+        }
+        else if(info.bits_per_pixel == 4 && rle){
+            read_rle(asset, size, img);
+        }
+        else if(info.bits_per_pixel == 8 || info.bits_per_pixel == 4 || info.bits_per_pixel == 1){
+            int pixels_per_byte = 8 / info.bits_per_pixel;
+            uint8_t index_mask = (1 << info.bits_per_pixel) - 1;
+            for(int i = 0; i < H; i++){
+                for(int j = 0; j < W; j++){
+                    uint8_t value = asset[info.image_data_offset + i*img.row_size + j/pixels_per_byte];
+                    int shift = 8 - info.bits_per_pixel * (j%pixels_per_byte + 1);
+                    insert_pixel(img, palette_color(img, (value >> shift) & index_mask));
+                }
+            }
+        }
+        else{
+            throw std::invalid_argument("Unsupported color depth");
+        }
+        return img.pixels;
+    }
+
+private:
+    template<int W, int H, pformat F>
+    struct image{
+        bmp_static_info info;
+        std::array<uint8_t, static_cast<size_t>(W)*H*pformat_stride(F)> pixels;
+        size_t position;
+        int row_size;
+        std::array<RGB_color, 256> color_table;
+
+        uint32_t r_mask, g_mask, b_mask, a_mask;
+        uint8_t r_shift, g_shift, b_shift, a_shift;
+        int r_shiftback, g_shiftback, b_shiftback;
+    };
+
+    static constexpr uint16_t read_u16(const uint8_t* asset, size_t size, uint64_t offset){
+        if(offset + sizeof(uint16_t) > size){
+            throw std::invalid_argument("Read past the end of the asset");
+        }
+        return asset[offset] | (asset[offset + 1] << 8);
+    }
+
+    static constexpr uint32_t read_u32(const uint8_t* asset, size_t size, uint64_t offset){
+        return read_u16(asset, size, offset) | (static_cast<uint32_t>(read_u16(asset, size, offset + 2)) << 16);
+    }
+
+    //Pixels arrive in file order and are stored top to bottom
+    template<int W, int H, pformat F>
+    static constexpr void insert_pixel(image<W, H, F>& img, RGB_color c){
+        if(img.position >= static_cast<size_t>(W)*H){
+            throw std::invalid_argument("Pixel data exceeds the image size");
+        }
+        size_t row = img.position / W;
+        size_t column = img.position % W;
+        img.position++;
+        if(!img.info.topdown){
+            row = H - 1 - row;
+        }
+        size_t dst = (row*W + column) * pformat_stride(F);
+        if constexpr (F == RGB || F == RGBA){
+            img.pixels[dst] = c.r;
+            img.pixels[dst + 1] = c.g;
+            img.pixels[dst + 2] = c.b;
+            if constexpr (F == RGBA){
+                img.pixels[dst + 3] = c.a;
+            }
+        }
+#ifdef __cpp_lib_bit_cast
+        else{
+            float channels[4] = {c.r / 255.0f, c.g / 255.0f, c.b / 255.0f, c.a / 255.0f};
+            int channel_count = (F == RGBA32F) ? 4 : 3;
+            for(int i = 0; i < channel_count; i++){
+                std::array<uint8_t, sizeof(float)> bytes = std::bit_cast<std::array<uint8_t, sizeof(float)>>(channels[i]);
+                for(size_t k = 0; k < sizeof(float); k++){
+                    img.pixels[dst + i*sizeof(float) + k] = bytes[k];
+                }
+            }
+        }
+#endif
+    }
+
+    template<int W, int H, pformat F>
+    static constexpr void read_color_table(const uint8_t* asset, size_t size, image<W, H, F>& img){
+        int entry_size = (img.info.DIB_header_size == DIB_BITMAPCOREHEADER) ? 3 : 4;
+        uint64_t color_table_offset = img.info.DIB_header_size + DIB_HEADER_SIZE_OFFSET;
+        if(color_table_offset + img.info.color_pallete_colors*entry_size > size){
+            throw std::invalid_argument("Color table exceeds the asset");
+        }
+        for(uint32_t i = 0; i < img.info.color_pallete_colors; i++){
+            uint64_t offset = color_table_offset + i*entry_size;
+            img.color_table[i] = RGB_color(asset[offset + 2], asset[offset + 1], asset[offset]);
+        }
+    }
+
+    template<int W, int H, pformat F>
+    static constexpr RGB_color palette_color(const image<W, H, F>& img, uint32_t index){
+        if(index >= img.info.color_pallete_colors){
+            throw std::invalid_argument("Color index is outside of the color table");
+        }
+        return img.color_table[index];
+    }
+
+    template<int W, int H, pformat F>
+    static constexpr void read_bitfield_mask(const uint8_t* asset, size_t size, image<W, H, F>& img){
+        //Same layout as bmp_reader::get_bitfield_mask, the masks sit at a fixed offset for every header version
+        if(img.info.compression_method == BI_BITFIELDS){
+            img.r_mask = read_u32(asset, size, BITFIELD_MASKS_OFFSET);
+            img.g_mask = read_u32(asset, size, BITFIELD_MASKS_OFFSET + 4);
+            img.b_mask = read_u32(asset, size, BITFIELD_MASKS_OFFSET + 8);
+            if(img.info.DIB_header_size >= DIB_BITMAPV3HEADER){
+                img.a_mask = read_u32(asset, size, ALPHA_MASK_OFFSET);
+                img.a_shift = trailing_zeroes(img.a_mask);
+            }
+        }
+        else if(img.info.bits_per_pixel == 16){
+            //Default colorspace for 16 bit is is RGB555
+            img.r_mask = 0b111110000000000;
+            img.g_mask = 0b000001111100000;
+            img.b_mask = 0b000000000011111;
+        }
+        else{
+            img.r_mask = 0x00ff0000;
+            img.g_mask = 0x0000ff00;
+            img.b_mask = 0x000000ff;
+        }
+        img.r_shift = trailing_zeroes(img.r_mask);
+        img.g_shift = trailing_zeroes(img.g_mask);
+        img.b_shift = trailing_zeroes(img.b_mask);
+        img.r_shiftback = 8 - low_byte_bits(img.r_mask >> img.r_shift);
+        img.g_shiftback = 8 - low_byte_bits(img.g_mask >> img.g_shift);
+        img.b_shiftback = 8 - low_byte_bits(img.b_mask >> img.b_shift);
+    }
+
+    static constexpr uint8_t trailing_zeroes(uint32_t v){
+        if(v == 0){
+            return 32;
+        }
+        uint8_t c = 0;
+        while((v & 1) == 0){
+            v >>= 1;
+            c++;
+        }
+        return c;
+    }
+
+    //Counts the set bits of the lowest byte, matching std::bitset<8> in bmp_reader
+    static constexpr int low_byte_bits(uint32_t v){
+        int c = 0;
+        for(int i = 0; i < 8; i++){
+            c += (v >> i) & 1;
+        }
+        return c;
+    }
+
+    enum rle_state{
+        INITIAL,
+        ZERO_BYTE,
+        ENCODED,
+        ABSOLUTE,
+        END
+    };
+
+    //Same state machine as bmp_reader::read_rle8 and read_rle4
+    template<int W, int H, pformat F>
+    static constexpr void read_rle(const uint8_t* asset, size_t size, image<W, H, F>& img){
+        bool rle4 = img.info.compression_method == BI_RLE4;
+        rle_state state = rle_state::INITIAL;
+        uint32_t bitmap_pos = 0;
+        int number_of_pixels = 0;
+        int total_pixels = 0;
+        while(bitmap_pos < img.info.size_in_bytes && state != rle_state::END){
+            if(img.info.image_data_offset + static_cast<uint64_t>(bitmap_pos) >= size){
+                throw std::invalid_argument("RLE data exceeds the asset");
+            }
+            uint8_t byte = asset[bitmap_pos + img.info.image_data_offset];
+            switch(state){
+                case rle_state::INITIAL: {
+                    if(byte == 0){
+                        state = rle_state::ZERO_BYTE;
+                    }
+                    else{
+                        state = rle_state::ENCODED;
+                        number_of_pixels = byte;
+                    }
+                    break;
+                }
+                case rle_state::ZERO_BYTE: {
+                    if(byte == 0 || byte == 2){
+                        //End of Line and Delta
+                        state = rle_state::INITIAL;
+                    }
+                    else if(byte == 1){
+                        state = rle_state::END;
+                    }
+                    else{
+                        number_of_pixels = byte;
+                        total_pixels = byte;
+                        state = rle_state::ABSOLUTE;
+                    }
+                    break;
+                }
+                case rle_state::ENCODED: {
+                    for(int i = 0; i < number_of_pixels; i++){
+                        if(!rle4){
+                            insert_pixel(img, palette_color(img, byte));
+                        }
+                        else{
+                            insert_pixel(img, palette_color(img, (i%2 == 0) ? (byte & 0xf0) >> 4 : byte & 0x0f));
+                        }
+                    }
+                    state = rle_state::INITIAL;
+                    break;
+                }
+                case rle_state::ABSOLUTE: {
+                    if(!rle4){
+                        insert_pixel(img, palette_color(img, byte));
+                        number_of_pixels--;
+                    }
+                    else{
+                        insert_pixel(img, palette_color(img, (byte & 0xf0) >> 4));
+                        number_of_pixels--;
+                        if(number_of_pixels > 0){
+                            insert_pixel(img, palette_color(img, byte & 0x0f));
+                            number_of_pixels--;
+                        }
+                    }
+                    if(number_of_pixels == 0){
+                        //Adjust the alignment to a 16 bit boundary
+                        if(!rle4 && total_pixels%2 != 0){
+                            bitmap_pos++;
+                        }
+                        else if(rle4 && total_pixels%4 != 0 && total_pixels%4 != 3){
+                            bitmap_pos++;
+                        }
+                        state = rle_state::INITIAL;
+                    }
+                    break;
+                }
+                default: break;
+            }
+            bitmap_pos++;
+        }
+    }
+};
+
+#endif